@@ -3,11 +3,50 @@
 #include "PCGParamData.h"
 #include "Data/PCGBasePointData.h"
 #include "Data/PCGSplineData.h"
+#include "Helpers/PCGHelpers.h"
 #include "Helpers/PCGPropertyHelpers.h"
+#include "HAL/LowLevelMemTracker.h"
 #include "PCGGrammarsWithConstraints/PCGConstrainedGrammarGenerator/source/public/Generator.hpp"
 #include "PCGGrammarsWithConstraints/PCGConstrainedGrammarGenerator/source/public/automaton/NFACompiler.hpp"
 #include "PCGGrammarsWithConstraints/PCGConstrainedGrammarGenerator/source/public/regex/RegexParser.hpp"
 
+LLM_DEFINE_TAG(PCGConstrainGrammar_Automata);
+LLM_DEFINE_TAG(PCGConstrainGrammar_Solver);
+
+DECLARE_CYCLE_STAT(TEXT("Generate With Constraints"), STAT_PCGConstrainGrammar_Generate, STATGROUP_PCGConstrainGrammar);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Aborted Generations"), STAT_PCGConstrainGrammar_NumAbortedGenerations, STATGROUP_PCGConstrainGrammar);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Verified Generations"), STAT_PCGConstrainGrammar_NumVerifiedGenerations, STATGROUP_PCGConstrainGrammar);
+
+namespace PCGConstrainGrammar
+{
+	/** Returns the cached entry with the given CRC and marks it as most recently used, or nullptr if there is none. */
+	template <typename T>
+	TSharedPtr<T> FindCachedEntry(TArray<TSharedPtr<T>>& Cache, uint32 Crc)
+	{
+		const int32 Index = Cache.IndexOfByPredicate([Crc](const TSharedPtr<T>& Entry) { return Entry->Crc == Crc; });
+		if (Index == INDEX_NONE)
+			return nullptr;
+
+		TSharedPtr<T> Entry = Cache[Index];
+		Cache.RemoveAt(Index, 1, EAllowShrinking::No);
+		Cache.Add(Entry);
+		return Entry;
+	}
+
+	/** Adds an entry unless one with the same CRC was added in the meantime, and evicts the least recently used entries beyond MaxEntries. */
+	template <typename T>
+	TSharedPtr<T> AddCachedEntry(TArray<TSharedPtr<T>>& Cache, const TSharedPtr<T>& NewEntry, int32 MaxEntries)
+	{
+		if (TSharedPtr<T> Entry = FindCachedEntry(Cache, NewEntry->Crc))
+			return Entry;
+
+		Cache.Add(NewEntry);
+		if (Cache.Num() > MaxEntries)
+			Cache.RemoveAt(0, Cache.Num() - MaxEntries);
+		return NewEntry;
+	}
+}
+
 TArray<FPCGPinProperties> UPCGConstrainGrammarSettings::InputPinProperties() const
 {
 	TArray<FPCGPinProperties> PinProperties;
@@ -73,28 +112,33 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 	auto* Context = static_cast<FPCGGrammarConstrainingContext*>(InContext);
 	check(Context);
 	Context->bFallbackToGrammar = Settings->bFallbackToOriginalGrammar;
+	Context->MaxCompiledGrammars = Settings->MaxCompiledGrammars;
+	Context->MaxModulesPerSolve = Settings->MaxModulesPerSolve;
+	Context->bMergeConstraintIntervals = Settings->bConstraintsAsInput && Settings->bMergeConstraintIntervals;
+	Context->DeterminismVerificationRatio = Settings->bVerifyDeterminism ? Settings->DeterminismVerificationRatio : 0.f;
 
 	// Read and check modules
-	auto Modules = GetModules(InContext, Settings);
-	if (Modules.IsEmpty())
+	Context->Modules = GetOrCreateModuleCache(InContext, Settings);
+	if (!Context->Modules)
 	{
 		PCGLog::LogErrorOnGraph(FText::FromString("No modules found!"), InContext);
 		return true;
 	}
-	for (const auto& Module : Modules)
+	for (const auto& Warning : Context->Modules->ModuleWarnings)
 	{
-		auto symbol = FStringToStd(Module.Symbol.ToString());
-		if (Context->ModuleMap.contains(symbol))
-		{
-			PCGLog::LogWarningOnGraph(FText::Format(PCGConstrainGrammar::Constants::DuplicatedSymbolText, FText::FromName(Module.Symbol)), InContext);
-			continue;
-		}
-		if (Module.Size <= 0)
+		PCGLog::LogWarningOnGraph(Warning, InContext);
+	}
+	Context->ModuleMap = Context->Modules->ModuleMap;
+
+	// constraint indices do not depend on the input shapes, so build them once for all of them. Only segments query the octree
+	TArray<TSharedPtr<const FPCGGrammarConstraintIndex>> ConstraintIndices;
+	if (Settings->bConstraintsAsInput)
+	{
+		for (const auto& ConstraintInput : InContext->InputData.GetInputsByPin(PCGConstrainGrammar::Constants::ConstraintsPinLabel))
 		{
-			PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Module {0} has size 0, will be ignored."), FText::FromName(Module.Symbol)), InContext);
-			continue;
+			const UPCGBasePointData* ConstraintPointData = Cast<const UPCGBasePointData>(ConstraintInput.Data);
+			ConstraintIndices.Add(GetOrCreateConstraintIndex(InContext, Settings, ConstraintPointData, /*bBuildOctree=*/Settings->SubdivisionType == Segment));
 		}
-		Context->ModuleMap.emplace(symbol, GrammarModule{symbol, static_cast<float>(Module.Size), Module.bSpawnOnlyWithConstraint});
 	}
 
 	if (Settings->SubdivisionType == Spline)
@@ -104,6 +148,8 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 		for (const auto& SplineInput : SplineInputs)
 		{
 			const UPCGSplineData* SplineData = Cast<const UPCGSplineData>(SplineInput.Data);
+			// splines have no point seed, so the spline is identified by its data, which does not depend on the input order or partitioning
+			const int SplineSeed = PCGHelpers::ComputeSeed(Context->GetSeed(), static_cast<int>(SplineData->GetOrComputeCrc(/*bFullDataCrc=*/true).GetValue()));
 
 			FString Grammar = Settings->GrammarSelection.GrammarString;
 			if (Settings->GrammarSelection.bGrammarAsAttribute)
@@ -115,7 +161,7 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 
 			if (!Settings->bConstraintsAsInput)
 			{
-				auto ConstrainedString = GenerateWithConstraints(Context, Grammar, SplineData->GetLength(), Settings->Constraints);
+				auto ConstrainedString = GenerateWithConstraints(Context, Grammar, SplineData->GetLength(), Settings->Constraints, SplineSeed);
 
 				// copy input data to output and add Grammar attribute
 				auto OutSplineData = SplineData->DuplicateData(InContext);
@@ -125,13 +171,11 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 			else
 			{
 				// if the constraints are provided through input pins, iterate over all constraint sets
-				TArray<FPCGTaggedData> ConstraintInputs = InContext->InputData.GetInputsByPin(PCGConstrainGrammar::Constants::ConstraintsPinLabel);
-				for (const auto& ConstraintInput : ConstraintInputs)
+				for (const auto& ConstraintIndex : ConstraintIndices)
 				{
-					const UPCGBasePointData* ConstraintPointData = Cast<const UPCGBasePointData>(ConstraintInput.Data);
-					auto Constraints = GetConstraintsOnSpline(InContext, Settings, SplineData, ConstraintPointData);
+					auto Constraints = GetConstraintsOnSpline(InContext, Settings, SplineData, *ConstraintIndex);
 
-					auto ConstrainedString = GenerateWithConstraints(Context, Grammar, SplineData->GetLength(), Constraints);
+					auto ConstrainedString = GenerateWithConstraints(Context, Grammar, SplineData->GetLength(), Constraints, SplineSeed);
 
 					// copy input data to output and add Grammar attribute
 					auto OutSplineData = SplineData->DuplicateData(InContext);
@@ -166,7 +210,8 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 				{
 					auto Grammar = Settings->GrammarSelection.bGrammarAsAttribute ? GrammarStrings[i] : Settings->GrammarSelection.GrammarString;
 					
-					auto ConstrainedString = GenerateWithConstraints(Context, Grammar, GetSegmentLength(SegmentData, i, Settings->SubdivisionAxis), Settings->Constraints);
+					const int SegmentSeed = PCGHelpers::ComputeSeed(Context->GetSeed(), SegmentData->GetSeed(i));
+					auto ConstrainedString = GenerateWithConstraints(Context, Grammar, GetSegmentLength(SegmentData, i, Settings->SubdivisionAxis), Settings->Constraints, SegmentSeed);
 					
 					ItemKeys.Add(OutSegmentData->GetMetadataEntry(i));
 					GeneratedStrings.Add(ConstrainedString);
@@ -177,10 +222,9 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 			else
 			{
 				// if the constraints are provided through input pins, iterate over all constraint sets
-				TArray<FPCGTaggedData> ConstraintInputs = InContext->InputData.GetInputsByPin(PCGConstrainGrammar::Constants::ConstraintsPinLabel);
-				for (auto ConstraintInput : ConstraintInputs)
+				for (const auto& ConstraintIndex : ConstraintIndices)
 				{
-					const UPCGBasePointData* ConstraintPointData = Cast<const UPCGBasePointData>(ConstraintInput.Data);
+					TBitArray<> UsedConstraints(false, ConstraintIndex->Num());
 
 					// copy input data to output and add Grammar attribute
 					auto OutSegmentData = Cast<UPCGBasePointData>(SegmentData->DuplicateData(InContext));
@@ -192,16 +236,27 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 					TArray<FString> GeneratedStrings;
 					for (int i = 0; i < OutSegmentData->GetNumPoints(); ++i)
 					{
-						auto Constraints = GetConstraintsOnSegment(InContext, Settings, SegmentData, i, ConstraintPointData);
+						auto Constraints = GetConstraintsOnSegment(Settings, SegmentData, i, *ConstraintIndex, UsedConstraints);
 						auto Grammar = Settings->GrammarSelection.bGrammarAsAttribute ? GrammarStrings[i] : Settings->GrammarSelection.GrammarString;
 						
-						auto ConstrainedString = GenerateWithConstraints(Context, Grammar, GetSegmentLength(SegmentData, i, Settings->SubdivisionAxis), Constraints);
+						const int SegmentSeed = PCGHelpers::ComputeSeed(Context->GetSeed(), SegmentData->GetSeed(i));
+						auto ConstrainedString = GenerateWithConstraints(Context, Grammar, GetSegmentLength(SegmentData, i, Settings->SubdivisionAxis), Constraints, SegmentSeed);
 					
 						ItemKeys.Add(OutSegmentData->GetMetadataEntry(i));
 						GeneratedStrings.Add(ConstrainedString);
 					}
 					// save the generated grammars to the output grammar attribute
 					GrammarAttribute->SetValues(ItemKeys, GeneratedStrings);
+
+					// warn once for every constraint that is not on any of the segments
+					for (int j = 0; j < ConstraintIndex->Num(); ++j)
+					{
+						if (!UsedConstraints[j])
+						{
+							PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Constraint symbol '{0}' is outside of the input shape, will be ignored."),
+							                                        FText::FromString(ConstraintIndex->Symbols[j])), InContext);
+						}
+					}
 				}
 			}
 		}
@@ -209,69 +264,173 @@ bool FPCGConstrainGrammarElement::ExecuteInternal(FPCGContext* InContext) const
 	return true;
 }
 
-FString FPCGConstrainGrammarElement::GenerateWithConstraints(FPCGGrammarConstrainingContext* Context, const FString& GrammarString, float Length, const TArray<FPCGGrammarConstraint>& Constraints)
+FString FPCGConstrainGrammarElement::GenerateWithConstraints(FPCGGrammarConstrainingContext* Context, const FString& GrammarString, float Length, const TArray<FPCGGrammarConstraint>& Constraints,
+                                                             int Seed)
 {
-	std::vector<GenerationConstraint> GenerationConstraints;
-	for (const auto& Constraint : Constraints)
-	{
-		auto ConstraintSymbol = FStringToStd(Constraint.Symbol.ToString());
-		if (!Context->ModuleMap.contains(ConstraintSymbol))
-		{
-			PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Constraint symbol '{0}' at position {1} is not included in modules, will be ignored."),
-			                                        Constraint.Symbol, Constraint.Position), Context);
-		}
-		else
-		{
-			GenerationConstraints.emplace_back(ConstraintSymbol, Constraint.Position, Constraint.bHasWidth ? Constraint.Width * 0.5f : 0.f);
-		}
-	}
+	const std::vector<GenerationConstraint> GenerationConstraints = MakeGenerationConstraints(Context, Constraints, /*bLogIgnored=*/true);
 	if (GenerationConstraints.empty())
 	{
 		PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("No constraints found for grammar '{0}'. Will return original string."),FText::FromString(GrammarString)), Context);
 		return GrammarString;
 	}
 
-	if (!MakeNFAForGrammar(Context, GrammarString))
+	// the search grows with the number of modules that fit into the shape, so refuse generations that could exceed the limit before compiling anything
+	if (Context->MaxModulesPerSolve > 0)
+	{
+		const float MinModuleSize = Context->Modules->GetMinFillModuleSize(GrammarString);
+		if (MinModuleSize > 0.f && Length > Context->MaxModulesPerSolve * MinModuleSize)
+		{
+			INC_DWORD_STAT(STAT_PCGConstrainGrammar_NumAbortedGenerations);
+			PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("Generation for grammar '{0}' with length {1} could place more than {2} modules, aborted."),
+			                                      FText::FromString(GrammarString), Length, Context->MaxModulesPerSolve), Context);
+			return Context->bFallbackToGrammar ? GrammarString : "";
+		}
+	}
+
+	EpsilonNFA* NFA = MakeNFAForGrammar(Context, GrammarString);
+	if (!NFA)
 	{
 		return Context->bFallbackToGrammar ? GrammarString : "";
 	}
-	
-	Generator GrammarGenerator(Context->ModuleMap, Length, Context->ConstructedNFAs[GrammarString], GenerationConstraints);
-	
-	if (GrammarGenerator.wasGenerationSuccessful())
-		return StdToFString(GrammarGenerator.getGenerationResult().getGeneratedString());
+
+	SCOPE_CYCLE_COUNTER(STAT_PCGConstrainGrammar_Generate);
+	LLM_SCOPE_BYTAG(PCGConstrainGrammar_Solver);
+
+	Generator GrammarGenerator(Context->ModuleMap, Length, *NFA, GenerationConstraints);
+	const bool bGenerationSuccessful = GrammarGenerator.wasGenerationSuccessful();
+	const FString GeneratedString = bGenerationSuccessful ? StdToFString(GrammarGenerator.getGenerationResult().getGeneratedString()) : FString();
+
+	if (Context->DeterminismVerificationRatio > 0.f && FRandomStream(Seed).FRand() < Context->DeterminismVerificationRatio)
+	{
+		VerifyDeterminism(Context, GrammarString, Length, Constraints, Seed, bGenerationSuccessful, GeneratedString);
+	}
+
+	if (bGenerationSuccessful)
+		return GeneratedString;
 
 	PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("The given constraints could not be satisfied for grammar '{0}'"), FText::FromString(GrammarString)), Context);
 	return Context->bFallbackToGrammar ? GrammarString : "";
 }
 
-bool FPCGConstrainGrammarElement::MakeNFAForGrammar(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString)
+EpsilonNFA* FPCGConstrainGrammarElement::MakeNFAForGrammar(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString)
+{
+	if (TSharedRef<EpsilonNFA>* ExecutionNFA = InContext->ExecutionNFAs.Find(GrammarString))
+		return &ExecutionNFA->Get();
+
+	TSharedPtr<const EpsilonNFA> SharedNFA = InContext->Modules->FindNFA(GrammarString);
+	if (!SharedNFA)
+	{
+		const TSharedPtr<EpsilonNFA> NFA = CompileNFA(InContext, GrammarString);
+		if (!NFA)
+			return nullptr;
+
+		const SIZE_T AllocatedSize = FPCGConstrainedGrammarModuleCache::GetNFAAllocatedSize(GrammarString, *NFA);
+		SharedNFA = InContext->Modules->AddNFA(GrammarString, NFA.ToSharedRef(), AllocatedSize, InContext->MaxCompiledGrammars);
+	}
+
+	// the shared NFA is only copied from, the generator works on a copy owned by this execution
+	LLM_SCOPE_BYTAG(PCGConstrainGrammar_Automata);
+	return &InContext->ExecutionNFAs.Emplace(GrammarString, MakeShared<EpsilonNFA>(*SharedNFA)).Get();
+}
+
+TSharedPtr<EpsilonNFA> FPCGConstrainGrammarElement::CompileNFA(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString)
+{
+	LLM_SCOPE_BYTAG(PCGConstrainGrammar_Automata);
+
+	const RegexParser Parser(FStringToStd(GrammarString), InContext->Modules->ModuleNameSet);
+	if (!Parser.wasParsingSuccessful())
+	{
+		if (Parser.getErrorInfo() == RegexErrorType::EmptyString)
+			PCGLog::LogErrorOnGraph(FText::FromString("The provided grammar is empty."), InContext);
+		else if (Parser.getErrorInfo() == RegexErrorType::UnknownLiteral)
+			PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("The grammar ({0}) contains a module that is not in the module list."), 
+				FText::FromString(GrammarString)), InContext);
+		else
+			PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("Grammar ({0}) could not be parsed."), FText::FromString(GrammarString)), InContext);
+		return nullptr;
+	}
+
+	const NFACompiler Compiler(Parser.getParsedRegex());
+	if (!Compiler.wasConstructionSuccessful())
+	{
+		PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("NFA could not be constructed for Grammar ({0})."), FText::FromString(GrammarString)), InContext);
+		return nullptr;
+	}
+
+	return MakeShared<EpsilonNFA>(Compiler.getConstructedNFA());
+}
+
+std::vector<GenerationConstraint> FPCGConstrainGrammarElement::MakeGenerationConstraints(FPCGGrammarConstrainingContext* Context, const TArray<FPCGGrammarConstraint>& Constraints,
+                                                                                        bool bLogIgnored)
 {
-	if (!InContext->ConstructedNFAs.Contains(GrammarString))
+	std::vector<GenerationConstraint> GenerationConstraints;
+	for (const auto& Constraint : CanonicalizeConstraints(Constraints, Context->bMergeConstraintIntervals))
 	{
-		const RegexParser Parser(FStringToStd(GrammarString), InContext->GetModuleNameSet());
-		if (!Parser.wasParsingSuccessful())
+		auto ConstraintSymbol = FStringToStd(Constraint.Symbol.ToString());
+		if (!Context->Modules->ModuleMap.contains(ConstraintSymbol))
 		{
-			if (Parser.getErrorInfo() == RegexErrorType::EmptyString)
-				PCGLog::LogErrorOnGraph(FText::FromString("The provided grammar is empty."), InContext);
-			else if (Parser.getErrorInfo() == RegexErrorType::UnknownLiteral)
-				PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("The grammar ({0}) contains a module that is not in the module list."), 
-					FText::FromString(GrammarString)), InContext);
-			else
-				PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("Grammar ({0}) could not be parsed."), FText::FromString(GrammarString)), InContext);
-			return false;
+			if (bLogIgnored)
+			{
+				PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Constraint symbol '{0}' at position {1} is not included in modules, will be ignored."),
+				                                        Constraint.Symbol, Constraint.Position), Context);
+			}
 		}
-
-		const NFACompiler Compiler(Parser.getParsedRegex());
-		if (!Compiler.wasConstructionSuccessful())
+		else
 		{
-			PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("NFA could not be constructed for Grammar ({0})."), FText::FromString(GrammarString)), InContext);
-			return false;
+			GenerationConstraints.emplace_back(ConstraintSymbol, Constraint.Position, Constraint.bHasWidth ? Constraint.Width * 0.5f : 0.f);
 		}
+	}
+	return GenerationConstraints;
+}
+
+void FPCGConstrainGrammarElement::VerifyDeterminism(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString, float Length,
+                                                    const TArray<FPCGGrammarConstraint>& Constraints, int Seed, bool bGenerationSuccessful, const FString& GeneratedString)
+{
+	INC_DWORD_STAT(STAT_PCGConstrainGrammar_NumVerifiedGenerations);
 
-		InContext->ConstructedNFAs.Emplace(GrammarString, Compiler.getConstructedNFA());
+	// shuffle the constraints, so that a result depending on their input order shows up as a difference
+	TArray<FPCGGrammarConstraint> ShuffledConstraints = Constraints;
+	// the first draw of Seed decided that this generation is verified, so the shuffle uses a derived seed to stay unbiased
+	FRandomStream RandomStream(PCGHelpers::ComputeSeed(Seed, 1));
+	for (int i = ShuffledConstraints.Num() - 1; i > 0; --i)
+	{
+		ShuffledConstraints.Swap(i, RandomStream.RandRange(0, i));
 	}
-	return true;
+	const std::vector<GenerationConstraint> GenerationConstraints = MakeGenerationConstraints(InContext, ShuffledConstraints, /*bLogIgnored=*/false);
+
+	// compile the grammar again instead of using the cached NFA, so that state shared between generations can not hide a difference
+	const TSharedPtr<EpsilonNFA> NFA = CompileNFA(InContext, GrammarString);
+	if (!NFA)
+		return;
+
+	LLM_SCOPE_BYTAG(PCGConstrainGrammar_Solver);
+
+	Generator VerificationGenerator(InContext->ModuleMap, Length, *NFA, GenerationConstraints);
+	const bool bVerificationSuccessful = VerificationGenerator.wasGenerationSuccessful();
+	const FString VerificationString = bVerificationSuccessful ? StdToFString(VerificationGenerator.getGenerationResult().getGeneratedString()) : FString();
+
+	if (bVerificationSuccessful != bGenerationSuccessful || !VerificationString.Equals(GeneratedString, ESearchCase::CaseSensitive))
+	{
+		PCGLog::LogErrorOnGraph(FText::Format(FText::FromString("Generation for grammar '{0}' is not deterministic: got '{1}', verification run got '{2}'."),
+		                                      FText::FromString(GrammarString), FText::FromString(GeneratedString), FText::FromString(VerificationString)), InContext);
+	}
+}
+
+TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::CanonicalizeConstraints(const TArray<FPCGGrammarConstraint>& Constraints, bool bMergeIntervals)
+{
+	TArray<FPCGGrammarConstraint> SortedConstraints = bMergeIntervals ? MergeConstraintIntervals(Constraints) : Constraints;
+	SortedConstraints.Sort([](const FPCGGrammarConstraint& A, const FPCGGrammarConstraint& B)
+	{
+		if (A.Position != B.Position)
+			return A.Position < B.Position;
+		const int SymbolCompare = A.Symbol.ToString().Compare(B.Symbol.ToString(), ESearchCase::CaseSensitive);
+		if (SymbolCompare != 0)
+			return SymbolCompare < 0;
+		if (A.bHasWidth != B.bHasWidth)
+			return B.bHasWidth;
+		return A.bHasWidth && A.Width < B.Width;
+	});
+	return SortedConstraints;
 }
 
 float FPCGConstrainGrammarElement::GetSegmentLength(const UPCGBasePointData* SegmentData, int SegmentIndex, EPCGSplitAxis SubdivisionAxis)
@@ -282,20 +441,18 @@ float FPCGConstrainGrammarElement::GetSegmentLength(const UPCGBasePointData* Seg
 }
 
 TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::GetConstraintsOnSpline(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGSplineData* SplineData,
-                                                                                  const UPCGBasePointData* ConstraintPointData)
+                                                                                  const FPCGGrammarConstraintIndex& ConstraintIndex)
 {
 	TArray<FPCGGrammarConstraint> Constraints;
 
-	TArray<FString> Symbols;
-	ReadAttributeValues(InContext, ConstraintPointData, InSettings->ConstraintAttributeNames.SymbolAttributeName, ConstraintPointData->GetNumPoints(), Symbols);
-
-	for (int i = 0; i < ConstraintPointData->GetNumPoints(); i++)
+	for (int i = 0; i < ConstraintIndex.Num(); i++)
 	{
 		FVector PositionOnSpline;
-		if (!SamplePointOnSpline(SplineData->SplineStruct, ConstraintPointData->GetTransform(i), FBox(ConstraintPointData->GetBoundsMin(i), ConstraintPointData->GetBoundsMax(i)), PositionOnSpline))
+		FVector SplineDirection;
+		if (!SamplePointOnSpline(SplineData->SplineStruct, ConstraintIndex.Transforms[i], ConstraintIndex.LocalBounds[i], PositionOnSpline, SplineDirection))
 		{
 			PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Constraint symbol '{0}' is outside of the input shape, will be ignored."),
-			                                        FText::FromString(Symbols[i])), InContext);
+			                                        FText::FromString(ConstraintIndex.Symbols[i])), InContext);
 			continue;
 		}
 
@@ -303,7 +460,28 @@ TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::GetConstraintsOnSplin
 		if (Distance < 0.0f || Distance > SplineData->GetLength())
 			continue;
 
-		Constraints.Emplace(FText::FromString(Symbols[i]), Distance, false, 0.0);
+		if (!ConstraintIndex.Widths.IsEmpty())
+		{
+			const double HalfWidth = ConstraintIndex.Widths[i] * 0.5;
+			AddClippedConstraint(Constraints, ConstraintIndex.Symbols[i], Distance - HalfWidth, Distance + HalfWidth, SplineData->GetLength());
+		}
+		else if (InSettings->ConstraintAttributeNames.bWidthFromBounds)
+		{
+			// project the oriented bounds of the constraint onto the spline direction
+			const FTransform& Transform = ConstraintIndex.Transforms[i];
+			const FBox& Bounds = ConstraintIndex.LocalBounds[i];
+			const FVector Extent = Bounds.GetExtent();
+			const double HalfWidth = FMath::Abs(Extent.X * (Transform.GetScaledAxis(EAxis::X) | SplineDirection))
+				+ FMath::Abs(Extent.Y * (Transform.GetScaledAxis(EAxis::Y) | SplineDirection))
+				+ FMath::Abs(Extent.Z * (Transform.GetScaledAxis(EAxis::Z) | SplineDirection));
+			const double CenterOffset = (Transform.TransformPosition(Bounds.GetCenter()) - Transform.GetLocation()) | SplineDirection;
+
+			AddClippedConstraint(Constraints, ConstraintIndex.Symbols[i], Distance + CenterOffset - HalfWidth, Distance + CenterOffset + HalfWidth, SplineData->GetLength());
+		}
+		else
+		{
+			Constraints.Emplace(FText::FromString(ConstraintIndex.Symbols[i]), Distance, false, 0.0);
+		}
 	}
 
 	return Constraints;
@@ -333,13 +511,14 @@ float FPCGConstrainGrammarElement::GetDistanceAlongSpline(const FPCGSplineStruct
 	return DistanceEstimate;
 }
 
-bool FPCGConstrainGrammarElement::SamplePointOnSpline(const FPCGSplineStruct& Spline, const FTransform& Transform, const FBox& Bounds, FVector& OutPosition)
+bool FPCGConstrainGrammarElement::SamplePointOnSpline(const FPCGSplineStruct& Spline, const FTransform& Transform, const FBox& Bounds, FVector& OutPosition, FVector& OutDirection)
 {
 	const FVector InPosition = Transform.GetLocation();
 	float NearestPointKey = Spline.FindInputKeyClosestToWorldLocation(InPosition);
 	FTransform NearestTransform = Spline.GetTransformAtSplineInputKey(NearestPointKey, ESplineCoordinateSpace::World, true);
 
 	OutPosition = NearestTransform.GetLocation();
+	OutDirection = NearestTransform.GetUnitAxis(EAxis::X);
 
 	FVector LocalPoint = NearestTransform.InverseTransformPosition(InPosition);
 	if (Bounds.IsInside(LocalPoint))
@@ -347,59 +526,202 @@ bool FPCGConstrainGrammarElement::SamplePointOnSpline(const FPCGSplineStruct& Sp
 	return false;
 }
 
-TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::GetConstraintsOnSegment(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGBasePointData* SegmentData,
-                                                                                   int SegmentIndex, const UPCGBasePointData* ConstraintPointData)
+TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::GetConstraintsOnSegment(const UPCGConstrainGrammarSettings* InSettings, const UPCGBasePointData* SegmentData, int SegmentIndex,
+                                                                                   const FPCGGrammarConstraintIndex& ConstraintIndex, TBitArray<>& OutUsedConstraints)
 {
 	TArray<FPCGGrammarConstraint> Constraints;
 
-	TArray<FString> Symbols;
-	ReadAttributeValues(InContext, ConstraintPointData, InSettings->ConstraintAttributeNames.SymbolAttributeName, ConstraintPointData->GetNumPoints(), Symbols);
-
 	const auto SegmentTransform = SegmentData->GetTransform(SegmentIndex);
 	const auto SegmentBounds = SegmentData->GetLocalBounds(SegmentIndex).TransformBy(SegmentTransform);
+	const double SegmentLength = GetVectorComponent(SegmentBounds.GetSize(), InSettings->SubdivisionAxis);
 
-	for (int i = 0; i < ConstraintPointData->GetNumPoints(); i++)
+	ConstraintIndex.ForEachIntersecting(SegmentBounds, [&](int32 i)
 	{
-		const auto ConstraintTransform = ConstraintPointData->GetTransform(i);
-		const auto ConstraintBounds = ConstraintPointData->GetLocalBounds(i).TransformBy(ConstraintTransform);
+		OutUsedConstraints[i] = true;
 
-		if (!SegmentBounds.Intersect(ConstraintBounds))
+		auto ClosestPoint = SegmentBounds.GetClosestPointTo(ConstraintIndex.Transforms[i].GetLocation());
+		auto Distances = ClosestPoint - SegmentBounds.Min;
+		float Distance = GetVectorComponent(Distances, InSettings->SubdivisionAxis);
+
+		if (!ConstraintIndex.Widths.IsEmpty())
 		{
-			PCGLog::LogWarningOnGraph(FText::Format(FText::FromString("Constraint symbol '{0}' is outside of the input shape, will be ignored."),
-			                                        FText::FromString(Symbols[i])), InContext);
-			continue;
+			const double HalfWidth = ConstraintIndex.Widths[i] * 0.5;
+			AddClippedConstraint(Constraints, ConstraintIndex.Symbols[i], Distance - HalfWidth, Distance + HalfWidth, SegmentLength);
+		}
+		else if (InSettings->ConstraintAttributeNames.bWidthFromBounds)
+		{
+			// use the part of the constraint bounds that overlaps the segment
+			const FBox& ConstraintBounds = ConstraintIndex.WorldBounds[i];
+			const double Lower = GetVectorComponent(ConstraintBounds.Min - SegmentBounds.Min, InSettings->SubdivisionAxis);
+			const double Upper = GetVectorComponent(ConstraintBounds.Max - SegmentBounds.Min, InSettings->SubdivisionAxis);
+
+			AddClippedConstraint(Constraints, ConstraintIndex.Symbols[i], Lower, Upper, SegmentLength);
+		}
+		else
+		{
+			Constraints.Emplace(FText::FromString(ConstraintIndex.Symbols[i]), Distance, false, 0.0);
 		}
+	});
 
-		auto ClosestPoint = SegmentBounds.GetClosestPointTo(ConstraintTransform.GetLocation());
-		auto Distances = ClosestPoint - SegmentBounds.Min;
-		float Distance = GetVectorComponent(Distances, InSettings->SubdivisionAxis);
+	return Constraints;
+}
+
+void FPCGConstrainGrammarElement::AddClippedConstraint(TArray<FPCGGrammarConstraint>& Constraints, const FString& Symbol, double Lower, double Upper, double Length)
+{
+	const double ClippedLower = FMath::Clamp(Lower, 0.0, Length);
+	const double ClippedUpper = FMath::Clamp(Upper, 0.0, Length);
+	Constraints.Emplace(FText::FromString(Symbol), (ClippedLower + ClippedUpper) * 0.5, true, ClippedUpper - ClippedLower);
+}
 
-		Constraints.Emplace(FText::FromString(Symbols[i]), Distance, false, 0.0);
+TSharedPtr<const FPCGGrammarConstraintIndex> FPCGConstrainGrammarElement::GetOrCreateConstraintIndex(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings,
+                                                                                                    const UPCGBasePointData* ConstraintPointData, bool bBuildOctree) const
+{
+	const FPCGGrammarConstraintAttributeNames& AttributeNames = InSettings->ConstraintAttributeNames;
+
+	// the full data CRC serializes all points, so only compute it when the index can be reused
+	uint32 Crc = 0;
+	if (InSettings->bShareDataAcrossExecutions)
+	{
+		Crc = ConstraintPointData->GetOrComputeCrc(/*bFullDataCrc=*/true).GetValue();
+		Crc = HashCombine(Crc, GetTypeHash(AttributeNames.SymbolAttributeName));
+		Crc = HashCombine(Crc, GetTypeHash(AttributeNames.bProvideWidth));
+		Crc = HashCombine(Crc, GetTypeHash(AttributeNames.WidthAttributeName));
+		Crc = HashCombine(Crc, GetTypeHash(bBuildOctree));
+
+		FScopeLock Lock(&CacheLock);
+		if (auto ConstraintIndex = PCGConstrainGrammar::FindCachedEntry(CachedConstraintIndices, Crc))
+			return ConstraintIndex;
 	}
 
-	return Constraints;
+	TArray<FString> Symbols;
+	ReadAttributeValues(InContext, ConstraintPointData, AttributeNames.SymbolAttributeName, ConstraintPointData->GetNumPoints(), Symbols);
+	TArray<double> Widths;
+	if (AttributeNames.bProvideWidth)
+	{
+		if (ReadAttributeValues(InContext, ConstraintPointData, AttributeNames.WidthAttributeName, ConstraintPointData->GetNumPoints(), Widths))
+		{
+			for (double& Width : Widths)
+			{
+				Width = FMath::Max(Width, 0.0);
+			}
+		}
+		else
+		{
+			Widths.Empty();
+		}
+	}
+
+	TSharedPtr<const FPCGGrammarConstraintIndex> ConstraintIndex = MakeShared<FPCGGrammarConstraintIndex>(Crc, MoveTemp(Symbols), MoveTemp(Widths), ConstraintPointData, bBuildOctree);
+
+	if (InSettings->bShareDataAcrossExecutions)
+	{
+		FScopeLock Lock(&CacheLock);
+		return PCGConstrainGrammar::AddCachedEntry(CachedConstraintIndices, ConstraintIndex, PCGConstrainGrammar::Constants::MaxSharedCacheEntries);
+	}
+	return ConstraintIndex;
 }
 
-TArray<FPCGConstrainedGrammarModule> FPCGConstrainGrammarElement::GetModules(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings)
+TSharedPtr<FPCGConstrainedGrammarModuleCache> FPCGConstrainGrammarElement::GetOrCreateModuleCache(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings) const
 {
-	if (!InSettings->bModuleInfoAsInput)
-		return InSettings->ModulesInfo;
+	const UPCGParamData* ModuleInfoData = nullptr;
+	if (InSettings->bModuleInfoAsInput)
+	{
+		ModuleInfoData = GetModuleInfoData(InContext);
+		if (!ModuleInfoData)
+			return nullptr;
+	}
 
+	const uint32 ModulesCrc = ComputeModulesCrc(InSettings, ModuleInfoData);
+	{
+		FScopeLock Lock(&CacheLock);
+		if (auto ModuleCache = PCGConstrainGrammar::FindCachedEntry(CachedModules, ModulesCrc))
+			return ModuleCache;
+	}
+
+	const auto Modules = GetModules(InContext, InSettings, ModuleInfoData);
+	if (Modules.IsEmpty())
+		return nullptr;
+
+	LLM_SCOPE_BYTAG(PCGConstrainGrammar_Automata);
+
+	TSharedPtr<FPCGConstrainedGrammarModuleCache> ModuleCache = MakeShared<FPCGConstrainedGrammarModuleCache>();
+	ModuleCache->Crc = ModulesCrc;
+	for (const auto& Module : Modules)
+	{
+		auto symbol = FStringToStd(Module.Symbol.ToString());
+		if (ModuleCache->ModuleMap.contains(symbol))
+		{
+			ModuleCache->ModuleWarnings.Add(FText::Format(PCGConstrainGrammar::Constants::DuplicatedSymbolText, FText::FromName(Module.Symbol)));
+			continue;
+		}
+		if (Module.Size <= 0)
+		{
+			ModuleCache->ModuleWarnings.Add(FText::Format(FText::FromString("Module {0} has size 0, will be ignored."), FText::FromName(Module.Symbol)));
+			continue;
+		}
+		ModuleCache->ModuleMap.emplace(symbol, GrammarModule{symbol, static_cast<float>(Module.Size), Module.bSpawnOnlyWithConstraint});
+		if (!Module.bSpawnOnlyWithConstraint)
+			ModuleCache->FillModuleSizes.emplace(symbol, static_cast<float>(Module.Size));
+	}
+	ModuleCache->FinalizeModules();
+
+	FScopeLock Lock(&CacheLock);
+	return PCGConstrainGrammar::AddCachedEntry(CachedModules, ModuleCache, InSettings->bShareDataAcrossExecutions ? PCGConstrainGrammar::Constants::MaxSharedCacheEntries : 1);
+}
+
+const UPCGParamData* FPCGConstrainGrammarElement::GetModuleInfoData(FPCGContext* InContext)
+{
 	const TArray<FPCGTaggedData> ModulesInfoInputs = InContext->InputData.GetInputsByPin(PCGSubdivisionBase::Constants::ModulesInfoPinLabel);
 
 	if (ModulesInfoInputs.IsEmpty())
 	{
 		PCGLog::LogWarningOnGraph(FText::FromString("No data was found on the module info pin."), InContext);
-		return {};
+		return nullptr;
 	}
 
 	const UPCGParamData* ParamData = Cast<UPCGParamData>(ModulesInfoInputs[0].Data);
 	if (!ParamData)
 	{
 		PCGLog::LogWarningOnGraph(FText::FromString("Module info input is not of type attribute set."), InContext);
-		return {};
+		return nullptr;
+	}
+
+	return ParamData;
+}
+
+uint32 FPCGConstrainGrammarElement::ComputeModulesCrc(const UPCGConstrainGrammarSettings* InSettings, const UPCGParamData* ModuleInfoData)
+{
+	if (!ModuleInfoData)
+	{
+		uint32 Crc = GetTypeHash(InSettings->ModulesInfo.Num());
+		for (const auto& Module : InSettings->ModulesInfo)
+		{
+			// symbols are case sensitive in the module map, while FName hashes are not
+			Crc = HashCombine(Crc, FCrc::StrCrc32(*Module.Symbol.ToString()));
+			Crc = HashCombine(Crc, GetTypeHash(Module.Size));
+			Crc = HashCombine(Crc, GetTypeHash(Module.bSpawnOnlyWithConstraint));
+		}
+		return Crc;
 	}
 
+	const FPCGConstrainedGrammarModuleAttributeNames& AttributeNames = InSettings->ModulesInfoAttributeNames;
+	uint32 Crc = ModuleInfoData->GetOrComputeCrc(/*bFullDataCrc=*/true).GetValue();
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.SymbolAttributeName));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.SizeAttributeName));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.bProvideScalable));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.ScalableAttributeName));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.bProvideDebugColor));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.DebugColorAttributeName));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.bProvideSpawnOnlyWithConstraint));
+	Crc = HashCombine(Crc, GetTypeHash(AttributeNames.SpawnOnlyWithConstraintAttributeName));
+	return Crc;
+}
+
+TArray<FPCGConstrainedGrammarModule> FPCGConstrainGrammarElement::GetModules(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGParamData* ModuleInfoData)
+{
+	if (!InSettings->bModuleInfoAsInput)
+		return InSettings->ModulesInfo;
+
 	TMap<FName, TTuple<FName, bool>> PropertyNameMapping;
 	PropertyNameMapping.Emplace(GET_MEMBER_NAME_CHECKED(FPCGConstrainedGrammarModule, Symbol), {InSettings->ModulesInfoAttributeNames.SymbolAttributeName, /*bCanBeDefaulted=*/false});
 	PropertyNameMapping.Emplace(GET_MEMBER_NAME_CHECKED(FPCGConstrainedGrammarModule, Size), {InSettings->ModulesInfoAttributeNames.SizeAttributeName, /*bCanBeDefaulted=*/false});
@@ -414,7 +736,45 @@ TArray<FPCGConstrainedGrammarModule> FPCGConstrainGrammarElement::GetModules(FPC
 		                            !InSettings->ModulesInfoAttributeNames.bProvideSpawnOnlyWithConstraint
 	                            });
 
-	return PCGPropertyHelpers::ExtractAttributeSetAsArrayOfStructs<FPCGConstrainedGrammarModule>(ParamData, &PropertyNameMapping, InContext);
+	return PCGPropertyHelpers::ExtractAttributeSetAsArrayOfStructs<FPCGConstrainedGrammarModule>(ModuleInfoData, &PropertyNameMapping, InContext);
+}
+
+TArray<FPCGGrammarConstraint> FPCGConstrainGrammarElement::MergeConstraintIntervals(const TArray<FPCGGrammarConstraint>& Constraints)
+{
+	auto GetLower = [](const FPCGGrammarConstraint& Constraint) { return Constraint.bHasWidth ? Constraint.Position - FMath::Max(Constraint.Width, 0.f) * 0.5f : Constraint.Position; };
+	auto GetUpper = [](const FPCGGrammarConstraint& Constraint) { return Constraint.bHasWidth ? Constraint.Position + FMath::Max(Constraint.Width, 0.f) * 0.5f : Constraint.Position; };
+
+	// order by symbol and interval start, so that mergeable constraints are next to each other
+	TArray<FPCGGrammarConstraint> SortedConstraints = Constraints;
+	SortedConstraints.Sort([&GetLower](const FPCGGrammarConstraint& A, const FPCGGrammarConstraint& B)
+	{
+		const int SymbolCompare = A.Symbol.ToString().Compare(B.Symbol.ToString(), ESearchCase::CaseSensitive);
+		if (SymbolCompare != 0)
+			return SymbolCompare < 0;
+		return GetLower(A) < GetLower(B);
+	});
+
+	TArray<FPCGGrammarConstraint> MergedConstraints;
+	for (const auto& Constraint : SortedConstraints)
+	{
+		if (!MergedConstraints.IsEmpty())
+		{
+			FPCGGrammarConstraint& Previous = MergedConstraints.Last();
+			const float PreviousUpper = GetUpper(Previous);
+			if (GetLower(Constraint) <= PreviousUpper + UE_KINDA_SMALL_NUMBER && Previous.Symbol.ToString().Equals(Constraint.Symbol.ToString(), ESearchCase::CaseSensitive))
+			{
+				const float Lower = GetLower(Previous);
+				const float Upper = FMath::Max(PreviousUpper, GetUpper(Constraint));
+				Previous.Position = (Lower + Upper) * 0.5f;
+				Previous.Width = Upper - Lower;
+				Previous.bHasWidth = Previous.Width > 0.f;
+				continue;
+			}
+		}
+		MergedConstraints.Add(Constraint);
+	}
+
+	return MergedConstraints;
 }
 
 FString FPCGConstrainGrammarElement::StdToFString(const std::string& String)
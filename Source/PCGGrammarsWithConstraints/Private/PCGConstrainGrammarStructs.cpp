@@ -5,8 +5,159 @@
 
 #include <ranges>
 
-std::set<std::string> FPCGGrammarConstrainingContext::GetModuleNameSet() const
+#include "Misc/ScopeLock.h"
+
+DECLARE_MEMORY_STAT(TEXT("Compiled Grammars Memory"), STAT_PCGConstrainGrammar_CompiledGrammarsMemory, STATGROUP_PCGConstrainGrammar);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Module Tables"), STAT_PCGConstrainGrammar_NumModuleTables, STATGROUP_PCGConstrainGrammar);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Compiled Grammars"), STAT_PCGConstrainGrammar_NumCompiledGrammars, STATGROUP_PCGConstrainGrammar);
+
+namespace PCGConstrainGrammarStructs
+{
+	/** Characters of the grammar syntax that separate module symbols. */
+	bool IsGrammarDelimiter(TCHAR Character)
+	{
+		return FChar::IsWhitespace(Character) || FCString::Strchr(TEXT("[]<>{}(),:*+?|"), Character) != nullptr;
+	}
+}
+
+FPCGConstrainedGrammarModuleCache::~FPCGConstrainedGrammarModuleCache()
+{
+	for (const auto& [GrammarString, CachedNFA] : ConstructedNFAs)
+	{
+		DEC_MEMORY_STAT_BY(STAT_PCGConstrainGrammar_CompiledGrammarsMemory, CachedNFA.AllocatedSize);
+	}
+	DEC_DWORD_STAT_BY(STAT_PCGConstrainGrammar_NumCompiledGrammars, ConstructedNFAs.Num());
+	if (bModulesFinalized)
+		DEC_DWORD_STAT(STAT_PCGConstrainGrammar_NumModuleTables);
+}
+
+void FPCGConstrainedGrammarModuleCache::FinalizeModules()
 {
 	auto ModuleKeys = std::views::keys(ModuleMap);
-	return {ModuleKeys.begin(), ModuleKeys.end()};
+	ModuleNameSet = {ModuleKeys.begin(), ModuleKeys.end()};
+
+	check(!bModulesFinalized);
+	bModulesFinalized = true;
+	INC_DWORD_STAT(STAT_PCGConstrainGrammar_NumModuleTables);
+}
+
+float FPCGConstrainedGrammarModuleCache::GetMinFillModuleSize(const FString& GrammarString) const
+{
+	float MinSize = 0.f;
+	int32 SymbolStart = 0;
+	for (int32 i = 0; i <= GrammarString.Len(); ++i)
+	{
+		if (i < GrammarString.Len() && !PCGConstrainGrammarStructs::IsGrammarDelimiter(GrammarString[i]))
+			continue;
+
+		// tokens that are no fill module, like repetition counts or spawn only modules, do not bound the generation
+		if (i > SymbolStart)
+		{
+			const auto FillModule = FillModuleSizes.find(TCHAR_TO_UTF8(*GrammarString.Mid(SymbolStart, i - SymbolStart)));
+			if (FillModule != FillModuleSizes.end() && (MinSize <= 0.f || FillModule->second < MinSize))
+				MinSize = FillModule->second;
+		}
+		SymbolStart = i + 1;
+	}
+	return MinSize;
+}
+
+TSharedPtr<const EpsilonNFA> FPCGConstrainedGrammarModuleCache::FindNFA(const FString& GrammarString) const
+{
+	FScopeLock Lock(&NFALock);
+	if (FCachedNFA* CachedNFA = ConstructedNFAs.Find(GrammarString))
+	{
+		CachedNFA->LastUse = ++NFAUseCounter;
+		return CachedNFA->NFA;
+	}
+	return nullptr;
+}
+
+TSharedRef<const EpsilonNFA> FPCGConstrainedGrammarModuleCache::AddNFA(const FString& GrammarString, const TSharedRef<const EpsilonNFA>& NFA, SIZE_T AllocatedSize,
+                                                                      int32 MaxNFAs) const
+{
+	FScopeLock Lock(&NFALock);
+	if (FCachedNFA* ExistingNFA = ConstructedNFAs.Find(GrammarString))
+	{
+		ExistingNFA->LastUse = ++NFAUseCounter;
+		return ExistingNFA->NFA;
+	}
+
+	// evicted NFAs are still valid for executions holding a reference to them, and are compiled again when needed
+	while (MaxNFAs > 0 && ConstructedNFAs.Num() >= MaxNFAs)
+	{
+		const FString* LeastRecentlyUsed = nullptr;
+		const FCachedNFA* LeastRecentlyUsedNFA = nullptr;
+		for (const auto& [CachedGrammar, CachedNFA] : ConstructedNFAs)
+		{
+			if (!LeastRecentlyUsedNFA || CachedNFA.LastUse < LeastRecentlyUsedNFA->LastUse)
+			{
+				LeastRecentlyUsed = &CachedGrammar;
+				LeastRecentlyUsedNFA = &CachedNFA;
+			}
+		}
+		DEC_MEMORY_STAT_BY(STAT_PCGConstrainGrammar_CompiledGrammarsMemory, LeastRecentlyUsedNFA->AllocatedSize);
+		DEC_DWORD_STAT(STAT_PCGConstrainGrammar_NumCompiledGrammars);
+		ConstructedNFAs.Remove(FString(*LeastRecentlyUsed));
+	}
+
+	INC_MEMORY_STAT_BY(STAT_PCGConstrainGrammar_CompiledGrammarsMemory, AllocatedSize);
+	INC_DWORD_STAT(STAT_PCGConstrainGrammar_NumCompiledGrammars);
+	ConstructedNFAs.Emplace(GrammarString, FCachedNFA{NFA, AllocatedSize, ++NFAUseCounter});
+	return NFA;
+}
+
+SIZE_T FPCGConstrainedGrammarModuleCache::GetNFAAllocatedSize(const FString& GrammarString, const EpsilonNFA& NFA)
+{
+	// the cache entry and its key, the states and transitions need an accessor in the generator library
+	return sizeof(FCachedNFA) + sizeof(NFA) + GrammarString.GetAllocatedSize();
+}
+
+FPCGGrammarConstraintIndex::FPCGGrammarConstraintIndex(uint32 InCrc, TArray<FString>&& InSymbols, TArray<double>&& InWidths, const UPCGBasePointData* ConstraintPointData,
+                                                       bool bBuildOctree)
+	: Crc(InCrc)
+	, Symbols(MoveTemp(InSymbols))
+	, Widths(MoveTemp(InWidths))
+{
+	check(Symbols.Num() == ConstraintPointData->GetNumPoints());
+	check(Widths.IsEmpty() || Widths.Num() == Symbols.Num());
+
+	Transforms.Reserve(Num());
+	LocalBounds.Reserve(Num());
+	WorldBounds.Reserve(Num());
+	for (int i = 0; i < Num(); ++i)
+	{
+		const FTransform& Transform = Transforms.Add_GetRef(ConstraintPointData->GetTransform(i));
+		const FBox& Bounds = LocalBounds.Add_GetRef(ConstraintPointData->GetLocalBounds(i));
+		WorldBounds.Add(Bounds.TransformBy(Transform));
+	}
+
+	if (bBuildOctree)
+	{
+		const FBox DataBounds = ConstraintPointData->GetBounds();
+		Octree = MakeUnique<FPCGGrammarConstraintOctree>(DataBounds.GetCenter(), FMath::Max(DataBounds.GetExtent().GetMax(), 1.0));
+		for (int i = 0; i < Num(); ++i)
+		{
+			Octree->AddElement({i, FBoxCenterAndExtent(WorldBounds[i])});
+		}
+	}
+}
+
+void FPCGGrammarConstraintIndex::ForEachIntersecting(const FBox& Bounds, TFunctionRef<void(int32)> Func) const
+{
+	if (!Octree)
+	{
+		for (int i = 0; i < Num(); ++i)
+		{
+			if (Bounds.Intersect(WorldBounds[i]))
+				Func(i);
+		}
+		return;
+	}
+
+	Octree->FindElementsWithBoundsTest(FBoxCenterAndExtent(Bounds), [this, &Bounds, &Func](const FPCGGrammarConstraintOctreeElement& Element)
+	{
+		if (Bounds.Intersect(WorldBounds[Element.Index]))
+			Func(Element.Index);
+	});
 }
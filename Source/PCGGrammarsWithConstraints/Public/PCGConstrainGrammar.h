@@ -18,6 +18,7 @@
 struct FPCGSplineStruct;
 class UPCGSplineData;
 class UPCGPolyLineData;
+class UPCGParamData;
 
 namespace PCGConstrainGrammar::Constants
 {
@@ -25,6 +26,9 @@ namespace PCGConstrainGrammar::Constants
 	const FName OutGrammarPinLabel = TEXT("OutGrammar");
 
 	static const FText DuplicatedSymbolText = FText::FromString("Symbol {0} is duplicated, ignored.");
+
+	/** Number of module tables and constraint indices kept per node when sharing data across executions. */
+	constexpr int32 MaxSharedCacheEntries = 16;
 }
 
 UCLASS(BlueprintType, ClassGroup = (Procedural))
@@ -34,6 +38,7 @@ class PCGGRAMMARSWITHCONSTRAINTS_API UPCGConstrainGrammarSettings : public UPCGS
 
 public:
 	//~Begin UPCGSettings interface
+	virtual bool UseSeed() const override { return true; }
 #if WITH_EDITOR
 	virtual FName GetDefaultNodeName() const override { return FName(TEXT("ConstrainGrammar")); }
 	virtual FText GetDefaultNodeTitle() const override { return NSLOCTEXT("PCGConstrainGrammarElement", "NodeTitle", "Constrain Grammar"); }
@@ -78,6 +83,13 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Settings|Constraints", meta = (EditCondition = "!bConstraintsAsInput", EditConditionHides, PCG_Overridable))
 	TArray<FPCGGrammarConstraint> Constraints;
 
+	/**
+	 * If true, overlapping or adjacent constraints with the same symbol read from the constraint points are merged into a single constraint
+	 * covering their combined interval. Constraints set on the node are never merged.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Settings|Constraints", meta = (EditCondition = "bConstraintsAsInput", EditConditionHides, PCG_Overridable))
+	bool bMergeConstraintIntervals = true;
+
 	/** An encoded string that represents how to apply a set of rules to a series of defined modules. */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Settings", meta = (ShowOnlyInnerProperties, PCG_Overridable))
 	FPCGGrammarSelection GrammarSelection;
@@ -89,6 +101,42 @@ public:
 	/** Determines the behaviour in case no grammar could be generated. If false, leave the grammar output empty. */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Settings", meta = (PCG_Overridable))
 	bool bFallbackToOriginalGrammar = true;
+
+	/**
+	 * If true, module tables, compiled grammars and constraint point indices are kept for all executions of this node and shared between them,
+	 * e.g. between the partitions of a partitioned generation. Otherwise only the module table of the last execution is kept.
+	 * The data is not scoped to a generation: it lives as long as the node's element, up to 16 module tables (each with up to Max Compiled Grammars
+	 * grammars) and 16 constraint indices, and stays in memory after the generation completed.
+	 * Constraint indices are only reused by executions with identical constraint data, and constraint points near partition borders are still
+	 * projected again in every partition whose shapes they touch.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, AdvancedDisplay, Category = "Settings|Performance")
+	bool bShareDataAcrossExecutions = false;
+
+	/**
+	 * Maximum number of compiled grammars cached for one module table. The least recently used ones are evicted and compiled again when needed,
+	 * so the limit never changes the generated result. 0 means no limit.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, AdvancedDisplay, Category = "Settings|Limits", meta = (ClampMin = "0", PCG_Overridable))
+	int32 MaxCompiledGrammars = 64;
+
+	/**
+	 * Maximum number of modules a single generation may place, estimated from the shape length and the smallest module the grammar can fill it with.
+	 * Larger generations are aborted before searching and use the fallback. 0 means no limit.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, AdvancedDisplay, Category = "Settings|Limits", meta = (ClampMin = "0", PCG_Overridable))
+	int32 MaxModulesPerSolve = 0;
+
+	/**
+	 * If true, a sample of the generations is run a second time without any cached data and an error is logged if the results differ.
+	 * Which generations are sampled depends on the seed of the node, the component and the point or spline data.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, AdvancedDisplay, Category = "Settings|Debug")
+	bool bVerifyDeterminism = false;
+
+	/** Share of the generations that are verified. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, AdvancedDisplay, Category = "Settings|Debug", meta = (EditCondition = "bVerifyDeterminism", ClampMin = "0", ClampMax = "1"))
+	float DeterminismVerificationRatio = 0.1f;
 };
 
 class FPCGConstrainGrammarElement : public IPCGElementWithCustomContext<FPCGGrammarConstrainingContext>
@@ -98,49 +146,100 @@ protected:
 
 private:
 	// Grammar constraining
-	static FString GenerateWithConstraints(FPCGGrammarConstrainingContext* Context, const FString& GrammarString, float Length, const TArray<FPCGGrammarConstraint>& Constraints);
+	/**
+	 * Generates a grammar that satisfies the constraints. The result only depends on the grammar, the modules, the length and the constraints,
+	 * not on the order of the constraints. Seed identifies the generated item and selects it for determinism verification.
+	 */
+	static FString GenerateWithConstraints(FPCGGrammarConstrainingContext* Context, const FString& GrammarString, float Length, const TArray<FPCGGrammarConstraint>& Constraints,
+	                                       int Seed);
+
+	/**
+	 * Sorts the constraints by position, symbol and width, so that their input order does not influence the generation.
+	 * If bMergeIntervals is true, overlapping or adjacent constraints with the same symbol are merged first.
+	 */
+	static TArray<FPCGGrammarConstraint> CanonicalizeConstraints(const TArray<FPCGGrammarConstraint>& Constraints, bool bMergeIntervals);
+
+	/** Merges overlapping or adjacent constraints with the same symbol into one constraint covering both intervals. */
+	static TArray<FPCGGrammarConstraint> MergeConstraintIntervals(const TArray<FPCGGrammarConstraint>& Constraints);
+
+	/** Canonicalizes the constraints and converts those with a known symbol for the generator. */
+	static std::vector<GenerationConstraint> MakeGenerationConstraints(FPCGGrammarConstrainingContext* Context, const TArray<FPCGGrammarConstraint>& Constraints, bool bLogIgnored);
+
+	/**
+	 * Runs the generation again with a freshly compiled NFA and the constraints shuffled by a seed derived from Seed,
+	 * and logs an error if the result differs from the given one.
+	 */
+	static void VerifyDeterminism(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString, float Length, const TArray<FPCGGrammarConstraint>& Constraints,
+	                              int Seed, bool bGenerationSuccessful, const FString& GeneratedString);
 	
 	/** 
-	 * If the context does not have a NFA for the given grammar yet, construct one and save it.
-	 * Returns true if the NFA already existed or was created, and false if the creation of the NFA failed.
+	 * If the module cache does not have a NFA for the given grammar yet, construct one and save it.
+	 * Returns this execution's copy of the NFA, or nullptr if the creation of the NFA failed.
 	 */
-	static bool MakeNFAForGrammar(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString);
+	static EpsilonNFA* MakeNFAForGrammar(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString);
+
+	/** Parses the grammar and compiles a new NFA for it, without using the module cache. Returns nullptr if parsing or compilation failed. */
+	static TSharedPtr<EpsilonNFA> CompileNFA(FPCGGrammarConstrainingContext* InContext, const FString& GrammarString);
 	
 	
 	// Spline helpers 
 	/** Maps the incoming constraint points onto the spline. */
 	static TArray<FPCGGrammarConstraint> GetConstraintsOnSpline(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGSplineData* SplineData,
-	                                                            const UPCGBasePointData* ConstraintPointData);
+	                                                            const FPCGGrammarConstraintIndex& ConstraintIndex);
 
 	/** Calculates the approximate distance along the spline. Accuracy increases with the amount of iterations. */
 	static float GetDistanceAlongSpline(const FPCGSplineStruct& Spline, const FVector& WorldPosition, int Iterations = 10);
 
-	/** Get the position on the spline that's closest to Transform. Returns true if this position is inside Bounds. */
-	static bool SamplePointOnSpline(const FPCGSplineStruct& Spline, const FTransform& Transform, const FBox& Bounds, FVector& OutPosition);
+	/** Get the position and direction of the spline where it is closest to Transform. Returns true if this position is inside Bounds. */
+	static bool SamplePointOnSpline(const FPCGSplineStruct& Spline, const FTransform& Transform, const FBox& Bounds, FVector& OutPosition, FVector& OutDirection);
 
 	// Segment helpers
-	/** Maps the incoming constraint points onto the segment. */
-	static TArray<FPCGGrammarConstraint> GetConstraintsOnSegment(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGBasePointData* SegmentData, int SegmentIndex,
-	                                                             const UPCGBasePointData* ConstraintPointData);
+	/** Maps the incoming constraint points onto the segment. Marks the constraints that intersect the segment in OutUsedConstraints. */
+	static TArray<FPCGGrammarConstraint> GetConstraintsOnSegment(const UPCGConstrainGrammarSettings* InSettings, const UPCGBasePointData* SegmentData, int SegmentIndex,
+	                                                             const FPCGGrammarConstraintIndex& ConstraintIndex, TBitArray<>& OutUsedConstraints);
 
 	/** Calculate the length of a segment depending on the subdivision axis. */
 	static float GetSegmentLength(const UPCGBasePointData* SegmentData, int SegmentIndex, EPCGSplitAxis SubdivisionAxis);
 
+	// Constraint helpers
+	/** 
+	 * Returns the index over the constraint points of ConstraintPointData, with an octree if bBuildOctree is true. When sharing data across executions,
+	 * indices are cached by the CRC of the constraint data and only built once.
+	 */
+	TSharedPtr<const FPCGGrammarConstraintIndex> GetOrCreateConstraintIndex(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings,
+	                                                                        const UPCGBasePointData* ConstraintPointData, bool bBuildOctree) const;
+
+	/** Adds a constraint covering the interval from Lower to Upper, clipped to the shape from 0 to Length. */
+	static void AddClippedConstraint(TArray<FPCGGrammarConstraint>& Constraints, const FString& Symbol, double Lower, double Upper, double Length);
+
+	// Module helpers
+	/** 
+	 * Returns the parsed modules for the current module info. The module map is only rebuilt if the module info changed since the last execution,
+	 * otherwise the cached one is reused together with all NFAs compiled against it. Returns nullptr if no modules were found.
+	 */
+	TSharedPtr<FPCGConstrainedGrammarModuleCache> GetOrCreateModuleCache(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings) const;
+
+	/** Returns the attribute set on the module info pin, or nullptr if there is none. */
+	static const UPCGParamData* GetModuleInfoData(FPCGContext* InContext);
+
+	/** Calculates a CRC of the module info. When reading the modules from input, the attribute name mapping is included as well. */
+	static uint32 ComputeModulesCrc(const UPCGConstrainGrammarSettings* InSettings, const UPCGParamData* ModuleInfoData);
+
 	// Attribute access helpers
 	/** Read module info from input if necessary. */
-	static TArray<FPCGConstrainedGrammarModule> GetModules(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings);
+	static TArray<FPCGConstrainedGrammarModule> GetModules(FPCGContext* InContext, const UPCGConstrainGrammarSettings* InSettings, const UPCGParamData* ModuleInfoData);
 	
 	/** Create a new attribute in Metadata and fill all entries with DefaultValue. */
 	template <typename T>
 	FPCGMetadataAttribute<T>* CreateOrOverwriteAttribute(FPCGContext* InContext, TObjectPtr<UPCGMetadata>& Metadata, const FName AttributeName, const T DefaultValue) const;
 
-	/** Read the values of an attribute in InData for NumValues entries. */
+	/** Read the values of an attribute in InData for NumValues entries. Returns false if the attribute could not be read, OutValues is default initialized then. */
 	template <typename T>
-	static void ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FName& AttributeName, int NumValues, TArray<T>& OutValues);
+	static bool ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FName& AttributeName, int NumValues, TArray<T>& OutValues);
 
-	/** Read the values of an attribute in InData for NumValues entries. */
+	/** Read the values of an attribute in InData for NumValues entries. Returns false if the attribute could not be read, OutValues is default initialized then. */
 	template <typename T>
-	static void ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FPCGAttributePropertyInputSelector& Attribute, int NumValues, TArray<T>& OutValues);
+	static bool ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FPCGAttributePropertyInputSelector& Attribute, int NumValues, TArray<T>& OutValues);
 
 	// Additional helper functions
 	/** Returns vector element X when Axis is X, and so on. */
@@ -151,6 +250,12 @@ private:
 	static FString StdToFString(const std::string& String);
 	/** Conversion function from std::string to FString */ 
 	static std::string FStringToStd(const FString& String);
+
+	/** Module caches of previous executions, most recently used last. Reused as long as the module info CRC stays the same. */
+	mutable TArray<TSharedPtr<FPCGConstrainedGrammarModuleCache>> CachedModules;
+	/** Constraint indices of previous executions, most recently used last. Only filled when sharing data across executions. */
+	mutable TArray<TSharedPtr<const FPCGGrammarConstraintIndex>> CachedConstraintIndices;
+	mutable FCriticalSection CacheLock;
 };
 
 template <typename T>
@@ -166,32 +271,35 @@ FPCGMetadataAttribute<T>* FPCGConstrainGrammarElement::CreateOrOverwriteAttribut
 }
 
 template <typename T>
-void FPCGConstrainGrammarElement::ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FName& AttributeName, int NumValues, TArray<T>& OutValues)
+bool FPCGConstrainGrammarElement::ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FName& AttributeName, int NumValues, TArray<T>& OutValues)
 {
 	FPCGAttributePropertyInputSelector Selector;
 	Selector.SetAttributeName(AttributeName);
-	ReadAttributeValues<T>(InContext, InData, Selector, NumValues, OutValues);
+	return ReadAttributeValues<T>(InContext, InData, Selector, NumValues, OutValues);
 }
 
 template <typename T>
-void FPCGConstrainGrammarElement::ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FPCGAttributePropertyInputSelector& Attribute, int NumValues, TArray<T>& OutValues)
+bool FPCGConstrainGrammarElement::ReadAttributeValues(FPCGContext* InContext, const UPCGData* InData, const FPCGAttributePropertyInputSelector& Attribute, int NumValues, TArray<T>& OutValues)
 {
+	OutValues.Empty();
+	OutValues.AddDefaulted(NumValues);
+
 	const FPCGAttributePropertyInputSelector Selector = Attribute.CopyAndFixLast(InData);
 	const TUniquePtr<const IPCGAttributeAccessor> Accessor = PCGAttributeAccessorHelpers::CreateConstAccessor(InData, Selector);
 	const TUniquePtr<const IPCGAttributeAccessorKeys> AccessorKeys = PCGAttributeAccessorHelpers::CreateConstKeys(InData, Selector);
 	if (!Accessor || !AccessorKeys)
 	{
 		PCGLog::Metadata::LogFailToCreateAccessorError(Selector, InContext);
+		return false;
 	}
 
-	OutValues.Empty();
-	OutValues.AddDefaulted(NumValues);
-	TArrayView<FString> Values(OutValues);
-
+	TArrayView<T> Values(OutValues);
 	if (!Accessor->GetRange(Values, 0, *AccessorKeys, EPCGAttributeAccessorFlags::AllowBroadcastAndConstructible))
 	{
-		PCGLog::Metadata::LogFailToGetAttributeError<int32>(Selector, Accessor.Get(), InContext);
+		PCGLog::Metadata::LogFailToGetAttributeError<T>(Selector, Accessor.Get(), InContext);
+		return false;
 	}
+	return true;
 }
 
 template <typename T>
@@ -5,12 +5,18 @@
 #include <string>
 
 #include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "Math/GenericOctree.h"
+#include "Stats/Stats.h"
 #include "Generator.hpp"
 #include "automaton/NFA.hpp"
+#include "Data/PCGBasePointData.h"
 #include "Elements/Grammar/PCGSubdivisionBase.h"
 
 #include "PCGConstrainGrammarStructs.generated.h"
 
+DECLARE_STATS_GROUP(TEXT("PCG Constrain Grammar"), STATGROUP_PCGConstrainGrammar, STATCAT_Advanced);
+
 USTRUCT(BlueprintType)
 struct FPCGGrammarConstraint
 {
@@ -40,6 +46,17 @@ struct FPCGGrammarConstraintAttributeNames
 	/** Mandatory. Expected type: FName. */
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "")
 	FName SymbolAttributeName = PCGSubdivisionBase::Constants::SymbolAttributeName;
+
+	/** If true, the constraint width is the extent of the point bounds along the subdivision direction. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "")
+	bool bWidthFromBounds = false;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "", meta = (InlineEditConditionToggle))
+	bool bProvideWidth = false;
+
+	/** Optional. Expected type: double. Takes precedence over the width from the point bounds. Negative widths are clamped to 0. */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "", meta = (EditCondition = "bProvideWidth"))
+	FName WidthAttributeName = TEXT("Width");
 };
 
 USTRUCT(BlueprintType)
@@ -88,11 +105,130 @@ enum SubdivisionType
 	Segment
 };
 
+/**
+ * Module table parsed from the module info, together with the NFAs compiled against it.
+ * Shared read-only between executions for as long as the module info does not change. Only the NFA cache is modified, under its lock.
+ */
+/** Map key functions for FString keys that compare and hash case-sensitively, matching the case-sensitive module symbols of the generator. */
+template <typename ValueType>
+struct TPCGCaseSensitiveStringMapKeyFuncs : TDefaultMapKeyFuncs<FString, ValueType, false>
+{
+	static bool Matches(const FString& A, const FString& B) { return A.Equals(B, ESearchCase::CaseSensitive); }
+	static uint32 GetKeyHash(const FString& Key) { return FCrc::StrCrc32(*Key); }
+};
+
+struct FPCGConstrainedGrammarModuleCache
+{
+	~FPCGConstrainedGrammarModuleCache();
+
+	/** CRC of the module info (and attribute name mapping) this cache was built from. */
+	uint32 Crc = 0;
+	std::map<std::string, GrammarModule> ModuleMap;
+	std::set<std::string> ModuleNameSet;
+	/** Sizes of the modules that can fill free space, i.e. all modules not spawned only with a constraint. */
+	std::map<std::string, float> FillModuleSizes;
+	/** Warnings raised while parsing the modules, reported again by every execution using this cache. */
+	TArray<FText> ModuleWarnings;
+
+	/** Fill ModuleNameSet from the keys of ModuleMap. Call once after ModuleMap is filled. */
+	void FinalizeModules();
+
+	/** Size of the smallest fill module referenced by the grammar, used to bound the number of modules it can generate. 0 if it references none. */
+	float GetMinFillModuleSize(const FString& GrammarString) const;
+
+	/** Returns the NFA compiled for the given grammar and marks it as most recently used, or nullptr if there is none yet. */
+	TSharedPtr<const EpsilonNFA> FindNFA(const FString& GrammarString) const;
+
+	/**
+	 * Store the NFA for the given grammar and evict the least recently used NFAs beyond MaxNFAs (0 means no limit).
+	 * AllocatedSize is accounted to the compiled grammar memory stat while the NFA is cached.
+	 * If another execution added one in the meantime, the existing one is kept and returned.
+	 */
+	TSharedRef<const EpsilonNFA> AddNFA(const FString& GrammarString, const TSharedRef<const EpsilonNFA>& NFA, SIZE_T AllocatedSize, int32 MaxNFAs) const;
+
+	/**
+	 * Memory of a compiled NFA as far as it is known to the plugin. The generator library does not expose the number of states and
+	 * transitions, so the heap memory of the automaton itself is only tracked by the PCGConstrainGrammar_Automata LLM tag.
+	 */
+	static SIZE_T GetNFAAllocatedSize(const FString& GrammarString, const EpsilonNFA& NFA);
+
+private:
+	struct FCachedNFA
+	{
+		TSharedRef<const EpsilonNFA> NFA;
+		SIZE_T AllocatedSize = 0;
+		uint64 LastUse = 0;
+	};
+
+	mutable TMap<FString, FCachedNFA, FDefaultSetAllocator, TPCGCaseSensitiveStringMapKeyFuncs<FCachedNFA>> ConstructedNFAs;
+	mutable uint64 NFAUseCounter = 0;
+	mutable FCriticalSection NFALock;
+	bool bModulesFinalized = false;
+};
+
+struct FPCGGrammarConstraintOctreeElement
+{
+	int32 Index = INDEX_NONE;
+	FBoxCenterAndExtent Bounds;
+};
+
+struct FPCGGrammarConstraintOctreeSemantics
+{
+	enum { MaxElementsPerLeaf = 16 };
+	enum { MinInclusiveElementsPerNode = 7 };
+	enum { MaxNodeDepth = 12 };
+
+	typedef TInlineAllocator<MaxElementsPerLeaf> ElementAllocator;
+
+	FORCEINLINE static const FBoxCenterAndExtent& GetBoundingBox(const FPCGGrammarConstraintOctreeElement& Element) { return Element.Bounds; }
+	FORCEINLINE static bool AreElementsEqual(const FPCGGrammarConstraintOctreeElement& A, const FPCGGrammarConstraintOctreeElement& B) { return A.Index == B.Index; }
+	FORCEINLINE static void SetElementId(const FPCGGrammarConstraintOctreeElement& Element, FOctreeElementId2 Id) {}
+};
+
+typedef TOctree2<FPCGGrammarConstraintOctreeElement, FPCGGrammarConstraintOctreeSemantics> FPCGGrammarConstraintOctree;
+
+/**
+ * Constraint points read once from a constraint input, optionally with an octree over their world bounds.
+ * Read-only after construction, so it can be shared between executions.
+ */
+struct FPCGGrammarConstraintIndex
+{
+	FPCGGrammarConstraintIndex(uint32 InCrc, TArray<FString>&& InSymbols, TArray<double>&& InWidths, const UPCGBasePointData* ConstraintPointData, bool bBuildOctree);
+
+	/**
+	 * CRC of the constraint data, the symbol and width attribute names and whether an octree was built.
+	 * Only set when the index is shared between executions.
+	 */
+	uint32 Crc = 0;
+	TArray<FString> Symbols;
+	/** Widths read from the width attribute. Empty if no width attribute is provided. */
+	TArray<double> Widths;
+	TArray<FTransform> Transforms;
+	TArray<FBox> LocalBounds;
+	TArray<FBox> WorldBounds;
+
+	int32 Num() const { return Symbols.Num(); }
+
+	/** Calls Func with the index of every constraint point whose world bounds intersect Bounds. Without an octree, all points are tested. */
+	void ForEachIntersecting(const FBox& Bounds, TFunctionRef<void(int32)> Func) const;
+
+private:
+	TUniquePtr<FPCGGrammarConstraintOctree> Octree;
+};
+
 struct FPCGGrammarConstrainingContext : public FPCGContext
 {
-	TMap<FString, EpsilonNFA> ConstructedNFAs;
+	TSharedPtr<const FPCGConstrainedGrammarModuleCache> Modules;
+	/** Copies of the shared module map and NFAs owned by this execution, so the generator never gets the instances other executions read. */
 	std::map<std::string, GrammarModule> ModuleMap;
+	TMap<FString, TSharedRef<EpsilonNFA>, FDefaultSetAllocator, TPCGCaseSensitiveStringMapKeyFuncs<TSharedRef<EpsilonNFA>>> ExecutionNFAs;
 	bool bFallbackToGrammar = true;
-	
-	std::set<std::string> GetModuleNameSet() const;
+	/** 0 means no limit. */
+	int32 MaxCompiledGrammars = 64;
+	/** 0 means no limit. */
+	int32 MaxModulesPerSolve = 0;
+	/** Only set for constraints read from the constraint points. */
+	bool bMergeConstraintIntervals = false;
+	/** Share of the generations that are run twice to check that they are deterministic. 0 disables the verification. */
+	float DeterminismVerificationRatio = 0.f;
 };
\ No newline at end of file